@@ -2,8 +2,11 @@
 ** http-server.c
 */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,7 +15,10 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
 #include <strings.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/sendfile.h>
 #include <sys/socket.h>
@@ -21,6 +27,10 @@
 #include <unistd.h>
 #include <time.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 // constants
 static char const * const HTTP_200_FORMAT = "HTTP/1.1 200 OK\r\n\
 Content-Type: text/html\r\n\
@@ -35,6 +45,25 @@ static char const * const HTTP_404 = "HTTP/1.1 404 Not Found\r\nContent-Length:
 static int const HTTP_404_LENGTH = 45;
 static char const * const NAME_HTML = "<p>Welcome, %s!</p>";
 static int const NAME_HTML_LENGTH = 17;
+static char const * const DEFAULT_SHM_NAME = "/wordmatch_server";
+static char const * const KEYWORDS_FORMAT = "keywords-%d.txt";
+static char const * const STOPWORDS_FILE = "stopwords.txt";
+
+// sizes of the tables kept in the shared memory segment
+#define MAX_COOKIES 10
+#define MAX_WORDS 20
+#define WORD_LENGTH 64
+#define NAME_LENGTH 64
+#define MAX_PROCESSES 64
+#define MAX_ROOMS 8
+#define MAX_PLAYERS 32
+#define LIST_LENGTH (MAX_WORDS * (WORD_LENGTH + 2))
+// slots of the word index of a room, a power of two at least twice MAX_PLAYERS * MAX_WORDS
+#define INDEX_SIZE 2048
+#define MAX_ENTRIES (MAX_PLAYERS * MAX_WORDS)
+#define PAGE_LENGTH 4096
+#define IMAGES 4
+#define TRACE_RING 64
 
 // represents the types of method
 typedef enum
@@ -64,142 +93,900 @@ typedef enum{
     READY
 }status;
 
+// what an action of a player does to the game, each leads to a page
+typedef enum{
+    SEATED,
+    LEFT,
+    NO_VACANCY,
+    ACCEPTED,
+    DISCARDED,
+    IGNORED,
+    COMPLETED,
+    NOT_PLAYING
+}outcome;
+
+// the phases of a request timed by the tracer
+typedef enum{
+    PHASE_READ,
+    PHASE_PARSE,
+    PHASE_RESPOND,
+    PHASE_FILE,
+    PHASE_WRITE,
+    PHASES
+}phase;
+
+static char const * const PHASE_NAMES[] = {"read", "parse", "respond", "file", "write"};
+static char const * const TYPE_NAMES[] = {"GET_INTRO", "POST_NAME", "GET_START", "POST_QUIT",
+    "POST_GUESS", "ENDGAME", "DISCONNECTED", "INVALID", "RETRY"};
+
+// the breakdown of a request, in nanoseconds and system calls per phase
+typedef struct trace{
+    int sockfd;
+    int reqType;
+    time_t when;
+    long total;
+    long cpu;
+    long time[PHASES];
+    int syscalls[PHASES];
+}trace;
+
+// the totals of the requests received on a connection
+typedef struct usage{
+    long requests;
+    long total;
+    long cpu;
+    long syscalls;
+}usage;
+
 typedef struct request{
     bool dynamic;
     type reqType;
     char* value;
     bool cookie;
+    char username[NAME_LENGTH];
 } req;
 
 typedef struct cookie{
     long sessionID;
-    char* username;
+    char username[NAME_LENGTH];
 }cookie;
 
+typedef char keyword[WORD_LENGTH];
+
+// identifies a connection among all the server processes on the host
+typedef struct player{
+    int process;
+    int sockfd;
+}player;
+
+/*A slot held by each attached server process, the lock is kept for the
+  lifetime of the process so that its death can be detected by the others*/
+typedef struct process{
+    pthread_mutex_t alive;
+    pid_t pid;
+}process;
+
+// a word entered in a room and the bitmap of the players who entered it
+typedef struct entry{
+    keyword text;
+    uint32_t players;
+}entry;
+
+// a player of a room and the rendered list of the words it has entered
+typedef struct seat{
+    player who;
+    int score;
+    int words;
+    int length;
+    char list[LIST_LENGTH];
+}seat;
+
+/*A game of up to MAX_PLAYERS players, the unsettled players keep the seat
+  index they had when the game was completed by someone else. While the room
+  waits for players, the seats below joined given up by vacant players are
+  free for the next ones. Everything in the room is guarded by its own
+  robust lock*/
+typedef struct room{
+    pthread_mutex_t lock;
+    status stage;
+    int joined;
+    int vacant;
+    int currentRound;
+    time_t reaped;
+    seat seats[MAX_PLAYERS];
+    player unsettled[MAX_PLAYERS];
+    int entries;
+    uint16_t used[MAX_ENTRIES];
+    entry index[INDEX_SIZE];
+}room;
+
+// what a page shows of a game, copied out of the room before it is rendered
+typedef struct view{
+    int currentRound;
+    int words;
+    int length;
+    char list[LIST_LENGTH];
+}view;
+
+/*A set of words placed by a minimal perfect hash, a bucket either holds the
+  seed that spreads its words over free slots or the slot of its only word*/
+typedef struct dictionary{
+    int size;
+    int* seeds;
+    keyword* words;
+}dictionary;
+
+/*The state shared by every server process attached to the same segment,
+  the sessions and each of the rooms are guarded by their own robust locks*/
+typedef struct shared{
+    int initialised;
+    pthread_mutex_t sessionLock;
+    process processes[MAX_PROCESSES];
+    cookie cookieLib[MAX_COOKIES];
+    int currCookie;
+    int players;
+    int quorum;
+    room rooms[MAX_ROOMS];
+}shared;
+
 //static variables
-static cookie* cookieLib[10];
-static char* wordList1[20];
-static char* wordList2[20];
-static int currCookie = 0;
-static status stage = STANDBY;
-static int player1sock = -1;
-static int player2sock = -1;
-static int unsettledsock = -1;
-static int currentRound = -1;
+static shared* state = NULL;
+static int selfslot = -1;
+// the random generator of the process, seeded so that a simulation can be replayed
+static uint64_t randomState = 1;
+// the simulation drives the game without the network and keeps quiet
+static bool simulating = false;
+// the known keywords of each image and the words that never describe one
+static dictionary keywords[IMAGES + 1];
+static dictionary stopwords;
+/*The tracer, off unless a threshold is given. The current request is
+  timed phase by phase and copied into the ring when it is slow*/
+static long traceThreshold = 0;
+static trace current;
+static phase currentPhase;
+static struct timespec phaseStart;
+static struct timespec cpuStart;
+static trace slowRequests[TRACE_RING];
+static int slowCount = 0;
+static usage connUsage[FD_SETSIZE];
+static volatile sig_atomic_t dumpRequested = 0;
+// where the sockets of this process were seated, checked before each use
+static int seatRoom[FD_SETSIZE];
+static int seatIndex[FD_SETSIZE];
+
+//Return the identity of a socket owned by this process
+static player self(int sockfd){
+    player p;
+    p.process = selfslot;
+    p.sockfd = sockfd;
+    return p;
+}
+
+//Compare the identities of two connections
+static bool samePlayer(player a, player b){
+    return a.sockfd == b.sockfd && a.process == b.process;
+}
+
+//Mark a player slot as vacant
+static void clearPlayer(player* p){
+    p->process = -1;
+    p->sockfd = -1;
+}
+
+//Cut a value received from the client to the length that can be stored
+static void truncateValue(char* value, int length){
+    if(strlen(value) >= length) value[length - 1] = '\0';
+}
+
+/*FNV-1a hash of a word, the seed selects one of a family of hash functions.
+  The bits are mixed at the end since the low ones of FNV-1a are weak*/
+static uint32_t hashWord(char const* text, uint32_t seed){
+    uint32_t h = 2166136261u ^ seed;
+    for(; *text != '\0'; text++)
+        h = (h ^ (unsigned char) *text) * 16777619u;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    return h ^ (h >> 16);
+}
+
+//To tell whether a character is whitespace
+static bool blank(char c){
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
 
-//Enter the next round, assign a new and different picture ID for the server
-static void nextRound(){
-    if(currentRound == -1){
-        currentRound = rand()%4 + 1;
-    } else currentRound = (currentRound + rand() % 3) % 4 + 1;
+//To tell whether a character is markup, it never describes an image and is not echoed
+static bool markup(char c){
+    return c == '<' || c == '>' || c == '&' || c == '"' || c == '\'';
 }
 
-//If a player start a game, save the sockfd for that player
-static void setPlayer(int sockfd){
-    if(player1sock < 0){
-        player1sock = sockfd;
-    } else if (player2sock < 0){
-        player2sock = sockfd;
+//Return the value of a hex digit, or -1
+static int hexValue(char c){
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/*Decode an urlencoded value in place, fold it to lower case, drop the markup,
+  cut it to the length that can be stored and trim the whitespace around it,
+  stopping at '&', the end of string or end. Runs of plain characters are
+  folded 16 at a time*/
+static void normalise(char* value, char const* end, int length){
+    char* in = value;
+    char* out = value;
+    char const* stop;
+    char c;
+
+    while(in < end){
+        stop = end;
+#ifdef __SSE2__
+        if(end - in >= 16){
+            __m128i v = _mm_loadu_si128((__m128i const*) in);
+            //the bytes to be decoded or ending the value, any whitespace and the markup
+            __m128i special = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('%')),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('+'))),
+                    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('&')),
+                                 _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(' ')), _mm_set1_epi8(' '))));
+            special = _mm_or_si128(special,
+                    _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('<')),
+                                              _mm_cmpeq_epi8(v, _mm_set1_epi8('>'))),
+                                 _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                              _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')))));
+            int mask = _mm_movemask_epi8(special);
+            if(mask == 0){
+                __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                                              _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+                v = _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+                _mm_storeu_si128((__m128i*) out, v);
+                in += 16;
+                out += 16;
+                continue;
+            }
+            //decode up to the first special byte one by one
+            stop = in + __builtin_ctz(mask) + 1;
+        }
+#endif
+        while(in < stop){
+            c = *in;
+            if(c == '&' || c == '\0'){
+                in = (char*) end;
+                break;
+            }
+            if(c == '+'){
+                c = ' ';
+                in++;
+            } else if(c == '%' && end - in > 2 && hexValue(in[1]) >= 0 && hexValue(in[2]) >= 0){
+                c = (char) (hexValue(in[1]) * 16 + hexValue(in[2]));
+                in += 3;
+            } else in++;
+            if(c >= 'A' && c <= 'Z') c += 'a' - 'A';
+            //drop the leading whitespace, the decoded NULs and the markup
+            if(c == '\0' || markup(c) || (out == value && blank(c))) continue;
+            *out++ = c;
+        }
     }
+
+    //trim after cutting, so a value cut at a space has no trailing blank
+    if(out - value >= length) out = value + length - 1;
+    while(out > value && blank(out[-1])) out--;
+    *out = '\0';
 }
 
-//To tell whether the current socket is playing the game
-static bool isPlayer(int sockfd){
-    return player1sock == sockfd || player2sock ==sockfd;
+//Find the slot a word would occupy in a dictionary
+static int slotOf(dictionary const* d, char const* text){
+    int seed = d->seeds[hashWord(text, 0) % d->size];
+    if(seed < 0) return -seed - 1;
+    return hashWord(text, seed) % d->size;
 }
 
-/*If one of the players triggers the completion of the game
-  the other player is marked as unsettled*/
-static void record_unsettled(int sockfd){
-    if(player1sock == sockfd){
-        unsettledsock = player2sock;
-    } else if (player2sock == sockfd){
-        unsettledsock = player1sock;
+//To tell whether a word is in a dictionary
+static bool contains(dictionary const* d, char const* text){
+    return d->size > 0 && !strcmp(d->words[slotOf(d, text)], text);
+}
+
+static int compareWords(void const* a, void const* b){
+    return strcmp((char const*) a, (char const*) b);
+}
+
+/*Build the minimal perfect hash of a list of distinct words by hash and
+  displace: the buckets are placed from the largest, each searching for a
+  seed that sends its words to free slots, then the single words take the
+  slots left over*/
+static bool buildDictionary(dictionary* d, keyword* words, int n){
+    int i, j, k, b, seed, slot, largest = 0;
+    int* bucket = malloc(n * sizeof(int));
+    int* start = calloc(n + 1, sizeof(int));
+    int* members = malloc(n * sizeof(int));
+    int* order = malloc(n * sizeof(int));
+    int* placed = malloc(n * sizeof(int));
+    bool* taken = calloc(n, sizeof(bool));
+
+    d->size = n;
+    d->seeds = calloc(n, sizeof(int));
+    d->words = calloc(n, sizeof(keyword));
+
+    //group the words by bucket, members[start[b]..start[b+1]) are in bucket b
+    for(i = 0; i < n; i++){
+        bucket[i] = hashWord(words[i], 0) % n;
+        start[bucket[i] + 1]++;
+    }
+    for(b = 0; b < n; b++){
+        if(start[b + 1] > largest) largest = start[b + 1];
+        start[b + 1] += start[b];
+    }
+    for(b = 0; b < n; b++) placed[b] = start[b];
+    for(i = 0; i < n; i++) members[placed[bucket[i]]++] = i;
+    //order the buckets from the largest
+    for(k = largest, j = 0; k > 0; k--)
+        for(b = 0; b < n; b++)
+            if(start[b + 1] - start[b] == k) order[j++] = b;
+
+    for(i = 0; i < j && start[order[i] + 1] - start[order[i]] > 1; i++){
+        b = order[i];
+        for(seed = 1; seed < (1 << 20); seed++){
+            for(k = start[b]; k < start[b + 1]; k++){
+                slot = hashWord(words[members[k]], seed) % n;
+                if(taken[slot]) break;
+                taken[slot] = true;
+                placed[k - start[b]] = slot;
+            }
+            if(k == start[b + 1]) break;
+            while(k > start[b]) taken[placed[--k - start[b]]] = false;
+        }
+        if(seed == (1 << 20)){
+            d->size = 0;
+            break;
+        }
+        d->seeds[b] = seed;
+        for(k = start[b]; k < start[b + 1]; k++)
+            strcpy(d->words[placed[k - start[b]]], words[members[k]]);
+    }
+    for(slot = 0; d->size > 0 && i < j; i++){
+        b = order[i];
+        while(taken[slot]) slot++;
+        taken[slot] = true;
+        d->seeds[b] = -slot - 1;
+        strcpy(d->words[slot], words[members[start[b]]]);
+    }
+
+    free(bucket);
+    free(start);
+    free(members);
+    free(order);
+    free(placed);
+    free(taken);
+    if(d->size == 0){
+        free(d->seeds);
+        free(d->words);
+        return false;
+    }
+    return true;
+}
+
+/*Load a dictionary with one word per line, the file is optional and the
+  lines starting with '#' are comments*/
+static void loadDictionary(dictionary* d, char const* file){
+    char line[WORD_LENGTH * 2];
+    keyword* words = NULL;
+    int n = 0, i, j;
+    FILE* f = fopen(file, "r");
+
+    d->size = 0;
+    if(f == NULL) return;
+    while(fgets(line, sizeof(line), f) != NULL){
+        normalise(line, line + strlen(line), WORD_LENGTH);
+        if(line[0] == '\0' || line[0] == '#') continue;
+        if((n & (n - 1)) == 0) words = realloc(words, (n == 0 ? 1 : 2 * n) * sizeof(keyword));
+        strcpy(words[n++], line);
     }
+    fclose(f);
+
+    //the words must be distinct to be placed
+    if(n > 0) qsort(words, n, sizeof(keyword), compareWords);
+    for(i = 0, j = 0; i < n; i++){
+        if(j == 0 || strcmp(words[j - 1], words[i])) memmove(words[j++], words[i], sizeof(keyword));
+    }
+    if(j > 0 && !buildDictionary(d, words, j))
+        fprintf(stderr, "%s: cannot build the dictionary\n", file);
+    free(words);
+}
+
+//Load the optional dictionaries of the images and the stopwords
+static void loadDictionaries(){
+    char file[32];
+    int i;
+    for(i = 1; i <= IMAGES; i++){
+        sprintf(file, KEYWORDS_FORMAT, i);
+        loadDictionary(&keywords[i], file);
+    }
+    loadDictionary(&stopwords, STOPWORDS_FILE);
+}
+
+//Seed the random generator, the state of xorshift must not be zero
+static void seedRandom(uint64_t seed){
+    randomState = seed ^ 0x9e3779b97f4a7c15ull;
+    if(randomState == 0) randomState = 1;
+}
+
+//Return the next number of the xorshift64* generator
+static uint32_t nextRandom(){
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    return (uint32_t) ((randomState * 2685821657736338717ull) >> 32);
+}
+
+//Enter the next round, assign a new and different picture ID for the room
+static void nextRound(room* r){
+    if(r->currentRound == -1){
+        r->currentRound = nextRandom()%4 + 1;
+    } else r->currentRound = (r->currentRound + nextRandom() % 3) % 4 + 1;
 }
 
 //Clear the caches for the old game
-static void reset(){
-    int i = 0;
-    player1sock = -1;
-    player2sock = -1;
-    while (i < 20 && wordList1[i] != NULL) {
-       free(wordList1[i]);
-       wordList1[i] = NULL;
-       i++;
+static void reset(room* r){
+    int i;
+    for(i = 0; i < r->joined; i++){
+        clearPlayer(&r->seats[i].who);
+        r->seats[i].score = 0;
+        r->seats[i].words = 0;
+        r->seats[i].length = 0;
+        r->seats[i].list[0] = '\0';
+    }
+    r->joined = 0;
+    r->vacant = 0;
+    //clear only the slots taken by the game
+    for(i = 0; i < r->entries; i++){
+        r->index[r->used[i]].text[0] = '\0';
+        r->index[r->used[i]].players = 0;
+    }
+    r->entries = 0;
+}
+
+//Clear a room whatever state it was left in
+static void clearRoom(room* r){
+    int i;
+    r->stage = STANDBY;
+    r->joined = 0;
+    r->vacant = 0;
+    r->entries = 0;
+    for(i = 0; i < MAX_PLAYERS; i++){
+        clearPlayer(&r->seats[i].who);
+        r->seats[i].score = 0;
+        r->seats[i].words = 0;
+        r->seats[i].length = 0;
+        r->seats[i].list[0] = '\0';
+    }
+    memset(r->index, 0, sizeof(r->index));
+}
+
+//Acquire a shared lock, return true if its owner died while holding it
+static bool lock(pthread_mutex_t* mutex){
+    int err = pthread_mutex_lock(mutex);
+    if(err == EOWNERDEAD){
+        pthread_mutex_consistent(mutex);
+        return true;
+    } else if(err != 0){
+        errno = err;
+        perror("pthread_mutex_lock");
+        exit(EXIT_FAILURE);
+    }
+    return false;
+}
+
+static void unlock(pthread_mutex_t* mutex){
+    pthread_mutex_unlock(mutex);
+}
+
+//Lock a room, the game may have been left half updated by a crash, so abandon it
+static void lockRoom(room* r){
+    if(lock(&r->lock)) clearRoom(r);
+}
+
+//Return the room a socket of this process was last seated in
+static room* roomOf(int sockfd){
+    return &state->rooms[seatRoom[sockfd]];
+}
+
+//To tell whether the process serving a player is still running
+static bool alive(player p){
+    int err;
+    pthread_mutex_t* mutex;
+    if(p.sockfd < 0 || p.process == selfslot) return true;
+    mutex = &state->processes[p.process].alive;
+    err = pthread_mutex_trylock(mutex);
+    if(err == EBUSY) return true;
+    //the slot is either abandoned or free, leave it free for the next process
+    if(err == EOWNERDEAD) pthread_mutex_consistent(mutex);
+    if(err == EOWNERDEAD || err == 0) pthread_mutex_unlock(mutex);
+    return false;
+}
+
+//To tell whether a process slot has crashed, each slot is only checked once
+static bool dead(player p, uint64_t* checked, uint64_t* crashed){
+    uint64_t bit;
+    if(p.sockfd < 0) return false;
+    bit = 1ull << p.process;
+    if(!(*checked & bit)){
+        *checked |= bit;
+        if(!alive(p)) *crashed |= bit;
     }
+    return (*crashed & bit) != 0;
+}
 
-    i = 0;
-    while (i < 20 && wordList2[i] != NULL) {
-        free(wordList2[i]);
-        wordList2[i] = NULL;
-        i++;
+/*End the game if a player was served by a process that has crashed. The
+  lock of each distinct process is tried once however many players it serves*/
+static void reapRoom(room* r){
+    uint64_t checked = 0, crashed = 0;
+    int i;
+    for(i = 0; i < r->joined; i++){
+        if(dead(r->seats[i].who, &checked, &crashed)){
+            r->stage = STANDBY;
+            reset(r);
+            break;
+        }
     }
+    for(i = 0; i < MAX_PLAYERS; i++){
+        if(dead(r->unsettled[i], &checked, &crashed)) clearPlayer(&r->unsettled[i]);
+    }
+    r->reaped = time(NULL);
+}
+
+//Reap a room at most once a second, so that a guess costs the same in a room of any size
+static void pollRoom(room* r){
+    if(r->reaped != time(NULL)) reapRoom(r);
 }
 
-//return the wordlist of the current player
-static char** listOf(int sockfd){
-    if(player1sock == sockfd){
-        return wordList1;
-    } else if (player2sock == sockfd){
-        return wordList2;
-    } else return NULL;
+/*Return the seat of a player and its room, or NULL if it is not playing.
+  The functions down to join expect the room of the player to be locked*/
+static seat* seatOf(int sockfd, room** r){
+    room* temp = roomOf(sockfd);
+    if(!samePlayer(temp->seats[seatIndex[sockfd]].who, self(sockfd))) return NULL;
+    if(r != NULL) *r = temp;
+    return &temp->seats[seatIndex[sockfd]];
 }
 
-//return the wordlist of the current opponent
-static char** listOfOpponent(int sockfd){
-    if(player1sock == sockfd){
-        return wordList2;
-    } else if (player2sock == sockfd){
-        return wordList1;
-    } else return NULL;
+//To tell whether the current socket is playing a game
+static bool isPlayer(int sockfd){
+    return seatOf(sockfd, NULL) != NULL;
 }
 
-//Concatenate the wordList to be a single string
-static char* concatenateList(int sockfd){
-    int len = 0;
-    int i = 0;
-    int j = 0;
-    char* temp;
-    char** tempList = listOf(sockfd);
+//If the game of the socket was completed by another player, settle it
+static bool settle(int sockfd){
+    room* r = roomOf(sockfd);
+    if(samePlayer(r->unsettled[seatIndex[sockfd]], self(sockfd))){
+        clearPlayer(&r->unsettled[seatIndex[sockfd]]);
+        return true;
+    }
+    return false;
+}
 
-    while(i < 20 && tempList[i] != NULL){
-        len += strlen(tempList[i]);
-        i++;
+/*If one of the players triggers the completion of the game
+  the other players are marked as unsettled*/
+static void record_unsettled(room* r, seat* winner){
+    int i;
+    for(i = 0; i < r->joined; i++){
+        if(&r->seats[i] != winner) r->unsettled[i] = r->seats[i].who;
     }
+}
 
-    len += 2 * (i-1);
-    temp = calloc(sizeof(char), len + 1);
+//Print the known keywords each player of a completed game has found
+static void reportScores(room* r, char* text){
+    int i;
+    if(simulating) return;
+    printf("room %d completed on \"%s\"\n", (int) (r - state->rooms), text);
+    for(i = 0; i < r->joined; i++){
+        printf("socket %d of process %d found %d known keywords\n", r->seats[i].who.sockfd,
+               state->processes[r->seats[i].who.process].pid, r->seats[i].score);
+    }
+}
 
-    while(j < 20 && tempList[j] != NULL){
-        strcat(temp, tempList[j]);
-        if(j != i -1) strcat(temp, ", ");
-        j++;
+/*End the game of a player who quits or leaves. A player still waiting for
+  the room to fill only gives up its seat, a running game ends for everyone*/
+static void leave(int sockfd){
+    room* r;
+    seat* s = seatOf(sockfd, &r);
+    if(s == NULL) return;
+    if(r->stage == PENDING_READY && r->joined - r->vacant > 1){
+        clearPlayer(&s->who);
+        r->vacant++;
+    } else {
+        r->stage = STANDBY;
+        reset(r);
     }
+}
 
-    return temp;
+/*Seat a player in the room waiting for players, or in a new room. The rooms
+  are locked one at a time, the room found is returned still locked, or NULL
+  if every room is playing*/
+static room* join(int sockfd){
+    int i, j, pass;
+    room* r;
+    //fill the rooms that are waiting for players before opening a new one
+    for(pass = 0; pass < 2; pass++){
+        for(i = 0; i < MAX_ROOMS; i++){
+            r = &state->rooms[i];
+            lockRoom(r);
+            reapRoom(r);
+            if(r->stage == PENDING_READY || (pass == 1 && r->stage == STANDBY)){
+                //Change the status to get ready for the game
+                if(r->stage == STANDBY){
+                    nextRound(r);
+                    r->stage = PENDING_READY;
+                }
+                //take a seat given up by a player who left, or the next one
+                if(r->vacant > 0){
+                    for(j = 0; r->seats[j].who.sockfd >= 0; j++);
+                    r->vacant--;
+                } else j = r->joined++;
+                seatRoom[sockfd] = i;
+                seatIndex[sockfd] = j;
+                r->seats[j].who = self(sockfd);
+                if(samePlayer(r->unsettled[j], self(sockfd))) clearPlayer(&r->unsettled[j]);
+                //Start the game once the room is full
+                if(r->joined == state->players && r->vacant == 0) r->stage = READY;
+                return r;
+            }
+            unlock(&r->lock);
+        }
+    }
+    return NULL;
 }
 
-//check if the word matches any word in the opponent's wordList
-static bool match(char* word, int sockfd){
-    int i = 0;
-    char ** tempList = listOfOpponent(sockfd);
+//Find the index entry of a word, adding it when it is new and add is set
+static entry* lookup(room* r, char* text, bool add){
+    uint32_t h = hashWord(text, 0);
+    entry* e;
+    //linear probing, the index is never more than half full
+    for(;; h++){
+        e = &r->index[h & (INDEX_SIZE - 1)];
+        if(e->text[0] == '\0'){
+            if(!add) return NULL;
+            strcpy(e->text, text);
+            r->used[r->entries++] = e - r->index;
+            return e;
+        }
+        if(!strcmp(e->text, text)) return e;
+    }
+}
 
-    while(i < 20 && tempList[i] != NULL){
-      if(!strcmp(tempList[i], word))  return true;
-      i++;
+//Append a word to the rendered word list of a player
+static void appendWord(seat* s, char* text){
+    if(s->words > 0){
+        memcpy(s->list + s->length, ", ", 2);
+        s->length += 2;
     }
+    strcpy(s->list + s->length, text);
+    s->length += strlen(text);
+    s->words++;
+}
 
+/*Record the guess of a player, return true if the word has now been entered
+  by enough players of the room to complete the game*/
+static bool guess(room* r, seat* s, char* text){
+    uint32_t bit = 1u << (s - r->seats);
+    uint32_t players = bit;
+    bool room_left = s->words < MAX_WORDS;
+    entry* e = lookup(r, text, room_left);
+
+    if(e != NULL) players |= e->players;
+    if(__builtin_popcount(players) >= state->quorum) return true;
+
+    if(room_left){
+        //score the known keywords of the image the first time they are found
+        if(!(e->players & bit) && contains(&keywords[r->currentRound], text)) s->score++;
+        e->players = players;
+        appendWord(s, text);
+    }
     return false;
 }
 
+//Copy what the page of a player shows of its game
+static void copyView(room* r, seat* s, view* v){
+    v->currentRound = r->currentRound;
+    v->words = s->words;
+    v->length = s->length;
+    memcpy(v->list, s->list, s->length + 1);
+}
+
+/*Press start: seat the player, or end its game if it is already playing,
+  i.e. it refreshed the page. The game API below locks the rooms itself and
+  copies what the page needs into v*/
+static outcome startGame(int sockfd, view* v){
+    room* r = roomOf(sockfd);
+    bool seated;
+    lockRoom(r);
+    seated = isPlayer(sockfd);
+    if(seated) leave(sockfd);
+    //a new game settles the old one
+    else settle(sockfd);
+    unlock(&r->lock);
+    if(seated) return LEFT;
+
+    if((r = join(sockfd)) == NULL) return NO_VACANCY;
+    v->currentRound = r->currentRound;
+    unlock(&r->lock);
+    return SEATED;
+}
+
+//Guess a word
+static outcome guessWord(int sockfd, char* text, view* v){
+    room* r = roomOf(sockfd);
+    seat* s = NULL;
+    outcome result = ACCEPTED;
+
+    lockRoom(r);
+    pollRoom(r);
+    //If the game is completed but not settled, end the game for the player
+    if(settle(sockfd)) result = COMPLETED;
+    //If the player is not playing a game
+    else if((s = seatOf(sockfd, NULL)) == NULL) result = NOT_PLAYING;
+    //If the room is not full yet, discard the word
+    else if(r->stage != READY) result = DISCARDED;
+    //Stopwords and empty guesses can't describe the image, ignore them
+    else if(text[0] == '\0' || contains(&stopwords, text)) result = IGNORED;
+    //Check if enough players have entered the word
+    else if(guess(r, s, text)){
+        //if so, reset the room and record the others' status as unsettled
+        reportScores(r, text);
+        record_unsettled(r, s);
+        r->stage = STANDBY;
+        reset(r);
+        result = COMPLETED;
+    }
+    if(result == ACCEPTED || result == DISCARDED || result == IGNORED) copyView(r, s, v);
+    unlock(&r->lock);
+    return result;
+}
+
+//End the game of a player who quits
+static void quitGame(int sockfd){
+    room* r = roomOf(sockfd);
+    lockRoom(r);
+    leave(sockfd);
+    unlock(&r->lock);
+}
+
+//End the game of a connection that is closed
+static void disconnect(int sockfd){
+    room* r = roomOf(sockfd);
+    lockRoom(r);
+    leave(sockfd);
+    settle(sockfd);
+    unlock(&r->lock);
+}
+
+//End the games and clear the unsettled players served by a process slot
+static void forgetProcess(int slot){
+    int i, j;
+    room* r;
+    for(i = 0; i < MAX_ROOMS; i++){
+        r = &state->rooms[i];
+        lockRoom(r);
+        for(j = 0; j < r->joined; j++){
+            if(r->seats[j].who.process == slot){
+                r->stage = STANDBY;
+                reset(r);
+                break;
+            }
+        }
+        for(j = 0; j < MAX_PLAYERS; j++){
+            if(r->unsettled[j].process == slot) clearPlayer(&r->unsettled[j]);
+        }
+        unlock(&r->lock);
+    }
+}
+
+//Take a free process slot and hold it until this process exits
+static void claimSlot(){
+    int i, err;
+    for(i = 0; i < MAX_PROCESSES; i++){
+        err = pthread_mutex_trylock(&state->processes[i].alive);
+        if(err == EOWNERDEAD) pthread_mutex_consistent(&state->processes[i].alive);
+        if(err == EOWNERDEAD || err == 0){
+            state->processes[i].pid = getpid();
+            selfslot = i;
+            //forget the players left behind by a previous owner of the slot
+            forgetProcess(i);
+            return;
+        }
+    }
+    fprintf(stderr, "too many server processes\n");
+    exit(EXIT_FAILURE);
+}
+
+//Initialise a mutex that can be shared and recovered between processes
+static void initLock(pthread_mutex_t* mutex){
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+//Initialise the locks and the tables of a new state
+static void initState(int players, int quorum){
+    int i, j;
+    initLock(&state->sessionLock);
+    for(i = 0; i < MAX_PROCESSES; i++)
+        initLock(&state->processes[i].alive);
+    state->currCookie = 0;
+    state->players = players;
+    state->quorum = quorum;
+    for(i = 0; i < MAX_ROOMS; i++){
+        initLock(&state->rooms[i].lock);
+        state->rooms[i].currentRound = -1;
+        for(j = 0; j < MAX_PLAYERS; j++)
+            clearPlayer(&state->rooms[i].unsettled[j]);
+        clearRoom(&state->rooms[i]);
+    }
+}
+
+/*Map the shared state, the first process creates and initialises the segment
+  and the others wait until it is ready. The segment is never unlinked, so it
+  outlives any of the processes*/
+static void attachState(char const* name, int players, int quorum){
+    bool creator = true;
+    int tries = 0;
+    struct stat st;
+    struct timespec pause = {0, 1000000};
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+
+    if(fd < 0 && errno == EEXIST){
+        creator = false;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if(fd < 0){
+        perror("shm_open");
+        exit(EXIT_FAILURE);
+    }
+    if(creator && ftruncate(fd, sizeof(shared)) < 0){
+        perror("ftruncate");
+        exit(EXIT_FAILURE);
+    }
+    //wait for the creator to size the segment
+    while(fstat(fd, &st) == 0 && st.st_size == 0 && tries++ < 1000)
+        nanosleep(&pause, NULL);
+    if(st.st_size != sizeof(shared)){
+        fprintf(stderr, "shared memory %s does not match this server, remove it first\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    state = mmap(NULL, sizeof(shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(state == MAP_FAILED){
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    if(creator){
+        initState(players, quorum);
+        __atomic_store_n(&state->initialised, 1, __ATOMIC_RELEASE);
+    } else {
+        tries = 0;
+        while(!__atomic_load_n(&state->initialised, __ATOMIC_ACQUIRE)){
+            if(tries++ == 1000){
+                fprintf(stderr, "shared memory %s was never initialised, remove it first\n", name);
+                exit(EXIT_FAILURE);
+            }
+            nanosleep(&pause, NULL);
+        }
+        if(state->players != players || state->quorum != quorum)
+            fprintf(stderr, "using the rooms of %d players and quorum %d of %s\n",
+                    state->players, state->quorum, name);
+    }
+    claimSlot();
+}
+
 //Check whether it's a duplicate sessionID
-static int uniqueID(int sessionID){
+static int uniqueID(long sessionID){
     int i;
-    for(i = 0; i < 10; i++){
-        if (cookieLib[i] != NULL){
-            if(cookieLib[i]->sessionID == sessionID) return false;
-        }
+    for(i = 0; i < MAX_COOKIES && i < state->currCookie; i++){
+        if(state->cookieLib[i].sessionID == sessionID) return false;
     }
     return true;
 }
@@ -210,41 +997,184 @@ static long generateCookie(char* username){
     int index;
     long sessionID;
 
+    lock(&state->sessionLock);
     //The server can only remeber the recent 10 visitors
-    if(currCookie < 10) {
-        index = currCookie;
-        cookieLib[index] = (cookie*) malloc(sizeof(cookie));
-    }
-    else {
-        index = currCookie % 10;
-        free(cookieLib[index]->username);
-    }
-    currCookie++;
+    index = state->currCookie % MAX_COOKIES;
     do{
-        sessionID = rand();
+        sessionID = nextRandom() & 0x7fffffff;
     }while(!uniqueID(sessionID));
+    state->currCookie++;
 
-    cookieLib[index]-> sessionID = sessionID;
-    cookieLib[index]-> username = calloc(sizeof(char), strlen(username) + 1);
-    memcpy(cookieLib[index]-> username, username, sizeof(char) * (strlen(username) + 1));
+    state->cookieLib[index].sessionID = sessionID;
+    strncpy(state->cookieLib[index].username, username, NAME_LENGTH - 1);
+    state->cookieLib[index].username[NAME_LENGTH - 1] = '\0';
+    unlock(&state->sessionLock);
 
     return sessionID;
 }
 
-//Give a cookie, return the corresponding name of that sessionID
-static char* searchCookie(long sessionID){
+//Give a cookie, copy the corresponding name of that sessionID to username
+static bool searchCookie(long sessionID, char* username){
     int i;
-    for(i = 0; i < 10; i++){
-        if(cookieLib[i] != NULL) {
-            if (cookieLib[i]->sessionID == sessionID)
-                return cookieLib[i]->username;
+    bool found = false;
+    lock(&state->sessionLock);
+    for(i = 0; i < MAX_COOKIES && i < state->currCookie; i++){
+        if (state->cookieLib[i].sessionID == sessionID){
+            memcpy(username, state->cookieLib[i].username, NAME_LENGTH);
+            found = true;
+            break;
         }
     }
-    return NULL;
+    unlock(&state->sessionLock);
+    return found;
+}
+
+//Return the nanoseconds elapsed from start to end
+static long elapsed(struct timespec* start, struct timespec* end){
+    return (end->tv_sec - start->tv_sec) * 1000000000L + end->tv_nsec - start->tv_nsec;
+}
+
+//Charge the time since the last switch to the current phase and enter another
+static phase tracePhase(phase next){
+    struct timespec now;
+    phase previous = currentPhase;
+    if(traceThreshold == 0) return previous;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    current.time[currentPhase] += elapsed(&phaseStart, &now);
+    phaseStart = now;
+    currentPhase = next;
+    return previous;
+}
+
+//Enter the phase of a system call and count it
+static phase traceSyscall(phase p){
+    if(traceThreshold == 0) return p;
+    current.syscalls[p]++;
+    return tracePhase(p);
+}
+
+//Start timing a request received on a socket
+static void traceBegin(int sockfd){
+    if(traceThreshold == 0) return;
+    memset(&current, 0, sizeof(current));
+    current.sockfd = sockfd;
+    current.reqType = -1;
+    currentPhase = PHASE_READ;
+    clock_gettime(CLOCK_MONOTONIC, &phaseStart);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuStart);
+}
+
+//Record the type of the request being timed
+static void traceRequest(type t){
+    current.reqType = t;
+}
+
+/*Finish timing the request, keep it in the ring if it is slow. A read that
+  only found the connection closed is not a request and is not kept*/
+static void traceEnd(){
+    struct timespec cpuEnd;
+    usage* u;
+    int i;
+    if(traceThreshold == 0 || current.reqType < 0) return;
+    tracePhase(PHASE_READ);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuEnd);
+    current.cpu = elapsed(&cpuStart, &cpuEnd);
+    for(i = 0; i < PHASES; i++) current.total += current.time[i];
+
+    u = &connUsage[current.sockfd];
+    u->requests++;
+    u->total += current.total;
+    u->cpu += current.cpu;
+    for(i = 0; i < PHASES; i++) u->syscalls += current.syscalls[i];
+
+    if(current.total >= traceThreshold){
+        current.when = time(NULL);
+        slowRequests[slowCount++ % TRACE_RING] = current;
+    }
+}
+
+//Forget the totals of a closed connection
+static void traceClose(int sockfd){
+    memset(&connUsage[sockfd], 0, sizeof(usage));
+}
+
+//Print the slow requests in the ring and the totals of the open connections
+static void traceDump(int maxfd){
+    int i, j;
+    trace* t;
+    usage* u;
+    if(traceThreshold == 0){
+        fprintf(stderr, "tracer disabled, start the server with -t\n");
+        return;
+    }
+    fprintf(stderr, "slowest requests over %ldus, %d captured\n", traceThreshold / 1000, slowCount);
+    for(i = slowCount > TRACE_RING ? slowCount - TRACE_RING : 0; i < slowCount; i++){
+        t = &slowRequests[i % TRACE_RING];
+        fprintf(stderr, "%ld socket %d %s total %ldus cpu %ldus", (long) t->when, t->sockfd,
+                TYPE_NAMES[t->reqType], t->total / 1000, t->cpu / 1000);
+        for(j = 0; j < PHASES; j++)
+            fprintf(stderr, " %s %ldus/%d", PHASE_NAMES[j], t->time[j] / 1000, t->syscalls[j]);
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, "open connections\n");
+    for(i = 0; i <= maxfd; i++){
+        u = &connUsage[i];
+        if(u->requests > 0)
+            fprintf(stderr, "socket %d requests %ld total %ldus cpu %ldus syscalls %ld\n",
+                    i, u->requests, u->total / 1000, u->cpu / 1000, u->syscalls);
+    }
+}
+
+static void requestDump(int signal){
+    dumpRequested = 1;
+}
+
+/*The system calls made while serving a request, each is counted and timed in
+  the phase it belongs to*/
+static ssize_t tracedRead(int fd, void* buff, size_t n, phase p){
+    phase previous = traceSyscall(p);
+    ssize_t result = read(fd, buff, n);
+    tracePhase(previous);
+    return result;
+}
+
+static ssize_t tracedWrite(int fd, void const* buff, size_t n){
+    phase previous = traceSyscall(PHASE_WRITE);
+    ssize_t result = write(fd, buff, n);
+    tracePhase(previous);
+    return result;
+}
+
+static ssize_t tracedSendfile(int sockfd, int filefd, size_t n){
+    phase previous = traceSyscall(PHASE_WRITE);
+    ssize_t result = sendfile(sockfd, filefd, NULL, n);
+    tracePhase(previous);
+    return result;
+}
+
+static int tracedStat(char const* file, struct stat* st){
+    phase previous = traceSyscall(PHASE_FILE);
+    int result = stat(file, st);
+    tracePhase(previous);
+    return result;
+}
+
+static int tracedOpen(char const* file){
+    phase previous = traceSyscall(PHASE_FILE);
+    int result = open(file, O_RDONLY);
+    tracePhase(previous);
+    return result;
+}
+
+static int tracedClose(int fd){
+    phase previous = traceSyscall(PHASE_FILE);
+    int result = close(fd);
+    tracePhase(previous);
+    return result;
 }
 
 //Parse the Request header to a structure type
-static req* parseRequest(char* buff, int sockfd){
+static req* parseRequest(char* buff, int len, int sockfd){
     req* temp = malloc(sizeof(req));
     char * curr = buff;
     METHOD method = UNKNOWN;
@@ -260,7 +1190,7 @@ static req* parseRequest(char* buff, int sockfd){
         curr += 5;
         method = POST;
     }
-    else if (write(sockfd, HTTP_400, HTTP_400_LENGTH) < 0)
+    else if (tracedWrite(sockfd, HTTP_400, HTTP_400_LENGTH) < 0)
     {
         perror("write");
         return NULL;
@@ -281,10 +1211,10 @@ static req* parseRequest(char* buff, int sockfd){
         //read the cookie and return to the start page if the sessionID is stored in the server
             else if ((curr = strstr(buff, "sessionID=")) != NULL) {
             long sessionID = atol(curr + 10);
-            if ((curr = searchCookie(sessionID)) != NULL) {
+            if (searchCookie(sessionID, temp->username)) {
                 temp->dynamic = true;
                 temp->reqType = POST_NAME;
-                temp->value = curr;
+                temp->value = temp->username;
                 temp->cookie = true;
             } else {
                 temp->dynamic = false;
@@ -312,12 +1242,13 @@ static req* parseRequest(char* buff, int sockfd){
             temp->reqType = POST_GUESS;
             temp->value = curr + 8;
             temp->cookie = false;
-            *strstr(curr,"&") = '\0';
+            normalise(temp->value, buff + len, WORD_LENGTH);
         } else if((curr = strstr(buff,"user=")) != NULL){
             temp->dynamic = true;
             temp->reqType = POST_NAME;
             temp->value = curr + 5;
             temp->cookie = false;
+            truncateValue(temp->value, NAME_LENGTH);
         } else {
             temp->dynamic = false;
             temp->reqType = INVALID;
@@ -343,11 +1274,6 @@ static bool response_static_request(type t, int sockfd){
     if(t == GET_INTRO){
         html = "1_intro.html";
     }  else if (t == POST_QUIT){
-        //reset the status if the request is from a current player
-        if(isPlayer(sockfd)) {
-            stage = STANDBY;
-            reset();
-        }
         html = "7_gameover.html";
     } else if (t == ENDGAME){
         html = "6_endgame.html";
@@ -363,40 +1289,41 @@ static bool response_static_request(type t, int sockfd){
     char buff[2049];
     int n;
     struct stat st;
-    stat(html, &st);
+    tracedStat(html, &st);
     n = sprintf(buff, HTTP_200_FORMAT, st.st_size);
-    if (write(sockfd, buff, n) < 0)
+    if (tracedWrite(sockfd, buff, n) < 0)
     {
         perror("write");
         return false;
     }
     // Send the file
-    int filefd = open(html, O_RDONLY);
+    int filefd = tracedOpen(html);
     do{
-        n = sendfile(sockfd, filefd, NULL, 2048);
+        n = tracedSendfile(sockfd, filefd, 2048);
     }
     while (n > 0);
     if (n < 0)
     {
         perror("sendfile");
-        close(filefd);
+        tracedClose(filefd);
         return false;
     }
-    close(filefd);
+    tracedClose(filefd);
     return true;
 }
 
 //Edit the html file in the buffer and send it to the client
 static bool response_dynamic_request(req* r, int sockfd){
     int n = 0;
-    int i = 0;
     int move_from = 0;
-    char ** wordList = NULL;
+    view v;
     char* html = NULL;
     char* insertion = NULL;
-    bool singleWord = false;
+    char const* verb = " has been ";
+    bool accepted = false;
+    outcome result = ACCEPTED;
     long added_length = 0;
-    char buff[2049];
+    char buff[PAGE_LENGTH + 1];
 
     //Decide which html file to read
     /**if name is posted**/
@@ -405,74 +1332,44 @@ static bool response_dynamic_request(req* r, int sockfd){
     }
     /**if guess is attemptted**/
     else if(r->reqType == POST_GUESS){
-        //If the game is completed but not settled, end the game for the player
-        if(sockfd == unsettledsock) {
-            unsettledsock = -1;
-            if (!response_static_request(ENDGAME, sockfd)) {
+        result = guessWord(sockfd, r->value, &v);
+        //If the game is completed, end the game for the player
+        if(result == COMPLETED){
+            if(!response_static_request(ENDGAME,sockfd)){
                 return false;
             }
             return true;
         }
-        //If the player is not playing the current game, show error messages
-        else if(!isPlayer(sockfd)){
+        //If the player is not playing a game, show error messages
+        else if(result == NOT_PLAYING){
             if (!response_static_request(DISCONNECTED, sockfd)) {
                 return false;
             }
             return true;
         }
-        if(stage == READY){
-            html = "4_accepted.html";
-            //Check if the player have a match
-            if(match(r->value, sockfd)) {
-                //if so, reset the game and record the opponent's status as unsettled
-                record_unsettled(sockfd);
-                stage = STANDBY;
-                reset();
-                //End the game
-                if(!response_static_request(ENDGAME,sockfd)){
-                    return false;
-                }
-                return true;
-            }
-        } else if(stage == PENDING_READY){
-            //If another player is not ready, return the discarded html
-            html = "5_discarded.html";
-        }   //If the other player has left the game, show error messages
-        else if(stage == STANDBY){
-            if (!response_static_request(DISCONNECTED, sockfd)) {
-                return false;
-            }
-            return true;
-        } else {
-            perror("stage error");
-            return false;
-        }
+        accepted = result == ACCEPTED;
+        if(accepted) html = "4_accepted.html";
+        else if(result == IGNORED) html = "10_ignored.html";
+        else html = "5_discarded.html";
     }
     /**if start button is pressed**/
     else if(r->reqType == GET_START){
         html = "3_first_turn.html";
-        //if the player is already in a game, i.e refresh the page, end game
-        if(isPlayer(sockfd)){
+        result = startGame(sockfd, &v);
+        //if the player was already in a game, i.e refresh the page, end game
+        if(result == LEFT){
             r->reqType = POST_QUIT;
             if(!response_static_request(POST_QUIT,sockfd)){
                 return false;
             }
             return true;
         }
-        //Change the status to get ready for the game
-        if(stage == STANDBY){
-            setPlayer(sockfd);
-            nextRound();
-            stage = PENDING_READY;
-        }
-        //Start the game by advancing the status again
-        else if(stage == PENDING_READY) {
-            setPlayer(sockfd);
-            stage = READY;
-        }
         //Prompt retry message if there are no vacancy for a new player
-        else if(!response_static_request(RETRY,sockfd)){
-            return false;
+        else if(result == NO_VACANCY){
+            if(!response_static_request(RETRY,sockfd)){
+                return false;
+            }
+            return true;
         }
     } else {
         perror("typeError");
@@ -481,7 +1378,7 @@ static bool response_dynamic_request(req* r, int sockfd){
 
     // get the size of the file
     struct stat st;
-    stat(html, &st);
+    tracedStat(html, &st);
     // increase file size to accommodate the username
 
     long size = 0;
@@ -502,59 +1399,40 @@ static bool response_dynamic_request(req* r, int sockfd){
             n = sprintf(buff, HTTP_200_FORMAT_COOKIE, size, randID);
         }
     } else if(r->reqType == POST_GUESS){
-        if(stage == READY){
-          /*Calculate the header of a single word Accepted Page*/
-            wordList = listOf(sockfd);
-            if(wordList[0] == NULL) {
-                singleWord = true;
-                added_length = strlen(r->value) + strlen(" has been ");
-                wordList[0] = (char*)calloc(sizeof(char), strlen(r->value) + 1);
-                memcpy(wordList[0], r->value, sizeof(char) * strlen(r->value) + 1);
-            }
-            else {
-            /*Calculate the header of mplti-word Accepted Page*/
-                singleWord = false;
-                while(i < 20){
-                    if(wordList[i] == NULL) {
-                        wordList[i] = (char*)calloc(sizeof(char), strlen(r->value) + 1);
-                        memcpy(wordList[i], r->value, sizeof(char) * strlen(r->value) + 1);
-                        break;
-                    }
-                    i++;
-                }
-                //Also convert the word list to a single string
-                insertion = concatenateList(sockfd);
-                added_length = strlen(insertion) + strlen(" have been ");
-            }
-        }/*Calculate the header of a Discarded Page*/
+        if(accepted){
+            /*Calculate the header of the Accepted Page from the word list
+            the player has built so far*/
+            if(v.words > 1) verb = " have been ";
+            added_length = v.length + strlen(verb);
+        }/*Calculate the header of a Discarded or Ignored Page*/
          else {
-            added_length = strlen(r->value) + strlen(" has been ");
+            added_length = strlen(r->value) + strlen(verb);
         }
         size = st.st_size + added_length;
         n = sprintf(buff, HTTP_200_FORMAT, size);
-    }/*Calculate the header of a First-turn Page*/
+        }/*Calculate the header of a First-turn Page*/
     else if(r->reqType == GET_START){
         size = st.st_size;
         n = sprintf(buff, HTTP_200_FORMAT, size);
     }
 
     // Send the HTTP response header
-    if (write(sockfd, buff, n) < 0)
+    if (tracedWrite(sockfd, buff, n) < 0)
     {
         perror("write");
         return false;
     }
 
     // Read the content of the HTML file
-    int filefd = open(html, O_RDONLY);
-    n = read(filefd, buff, 2048);
+    int filefd = tracedOpen(html);
+    n = tracedRead(filefd, buff, 2048, PHASE_FILE);
     if (n < 0)
     {
         perror("read");
-        close(filefd);
+        tracedClose(filefd);
         return false;
     }
-    close(filefd);
+    tracedClose(filefd);
 
     // Calculate the variables for editing the html page
     if(r->reqType == POST_NAME){
@@ -562,22 +1440,15 @@ static bool response_dynamic_request(req* r, int sockfd){
         insertion = (char*) calloc(sizeof(char), added_length);
         sprintf(insertion, NAME_HTML, r->value);
     } else if(r->reqType == POST_GUESS){
-        if(stage == READY){
+        insertion = (char*) calloc(sizeof(char), added_length + 1);
+        if(accepted){
             move_from = ((int) (strstr(buff, "Accepted!") - buff));
-            if(singleWord) {
-                insertion = (char*) calloc(sizeof(char), added_length + 1);
-                memcpy(insertion, wordList[0], sizeof(char)* (added_length +1));
-                strcat(insertion, " has been ");
-            } else {
-                insertion = realloc(insertion, sizeof(char)* (added_length +1));
-                strcat(insertion, " have been ");
-            }
+            memcpy(insertion, v.list, v.length);
         } else {
-            move_from = ((int) (strstr(buff, "Discarded.") - buff));
-            insertion = (char*) calloc(sizeof(char), added_length + 1);
-            memcpy(insertion, r->value, sizeof(char)* (strlen(r->value) +1));
-            strcat(insertion, " has been ");
+            move_from = ((int) (strstr(buff, result == IGNORED ? "Ignored," : "Discarded.") - buff));
+            strcpy(insertion, r->value);
         }
+        strcat(insertion, verb);
     }
     //Move the trailing part backward, the first_turn page don't have any insertion
     if(r->reqType != GET_START){
@@ -593,10 +1464,10 @@ static bool response_dynamic_request(req* r, int sockfd){
 
     //Change the picture
     if(r->reqType != POST_NAME)
-    *(strstr(buff, ".jpg") - 1) = (char) (currentRound + 48);
+    *(strstr(buff, ".jpg") - 1) = (char) (v.currentRound + 48);
 
     //Send the page
-    if (write(sockfd, buff, size) < 0)
+    if (tracedWrite(sockfd, buff, size) < 0)
     {
         perror("write");
         return false;
@@ -605,12 +1476,12 @@ static bool response_dynamic_request(req* r, int sockfd){
 }
 
 //Swicther of responses
-static bool handle_http_request(int sockfd)
+static bool serve_http_request(int sockfd)
 {
     // Try to read the request
     char buff[2049];
     req * request;
-    int n = read(sockfd, buff, 2049);
+    int n = tracedRead(sockfd, buff, 2048, PHASE_READ);
     if (n <= 0)
     {
         if (n < 0)
@@ -624,14 +1495,17 @@ static bool handle_http_request(int sockfd)
     buff[n] = 0;
 
     // Return the failure
-    if((request = parseRequest(buff,sockfd)) == NULL){
+    tracePhase(PHASE_PARSE);
+    if((request = parseRequest(buff,n,sockfd)) == NULL){
         return false;
     }
+    traceRequest(request->reqType);
+    tracePhase(PHASE_RESPOND);
 
     //Handle INVALID requests
     if (request->reqType == INVALID){
         fprintf(stderr, "no other methods supported");
-        if (write(sockfd, HTTP_404, HTTP_404_LENGTH) < 0)
+        if (tracedWrite(sockfd, HTTP_404, HTTP_404_LENGTH) < 0)
         {
             perror("write");
             free(request);
@@ -640,6 +1514,10 @@ static bool handle_http_request(int sockfd)
     }
     // Handle static responses
     else if (request->dynamic == false){
+        //reset the room if the request is from a current player
+        if(request->reqType == POST_QUIT){
+            quitGame(sockfd);
+        }
         if(!response_static_request(request->reqType, sockfd)){
             free(request);
             return false;
@@ -657,17 +1535,258 @@ static bool handle_http_request(int sockfd)
     return true;
 }
 
+//Stop the simulation on a broken invariant, the seed and event replay it
+static void simFail(uint64_t seed, long event, char const* what){
+    fprintf(stderr, "simulation seed %llu event %ld: %s\n", (unsigned long long) seed, event, what);
+    exit(EXIT_FAILURE);
+}
+
+//Check the stage and the seats of a room, return the broken invariant
+static char const* checkRoom(room* r){
+    int i;
+    room* where;
+    int vacant = 0;
+    if(r->joined < 0 || r->joined > state->players) return "seat count out of range";
+    if((r->stage == STANDBY) != (r->joined == 0)) return "idle room with players";
+    if((r->stage == READY) != (r->joined == state->players && r->vacant == 0))
+        return "stage does not match the players";
+    if(r->stage != PENDING_READY && r->vacant != 0) return "vacant seat outside a waiting room";
+    for(i = 0; i < MAX_PLAYERS; i++){
+        seat* s = &r->seats[i];
+        if(i >= r->joined){
+            if(s->who.sockfd >= 0 || s->words > 0) return "leftover seat";
+            continue;
+        }
+        if(s->who.sockfd < 0){
+            if(s->words > 0) return "words on a vacant seat";
+            vacant++;
+            continue;
+        }
+        if(seatOf(s->who.sockfd, &where) != s) return "seat not found from its player";
+        if(s->words > MAX_WORDS || s->length != (int) strlen(s->list)) return "word list out of sync";
+    }
+    if(vacant != r->vacant || (vacant > 0 && vacant == r->joined)) return "vacant seats out of sync";
+    return NULL;
+}
+
+/*Check the word index of a room: every word is found where it is, no word
+  has reached the quorum and only seated players have entered words*/
+static char const* checkIndex(room* r){
+    int i, words = 0;
+    uint32_t seated = r->joined == MAX_PLAYERS ? ~0u >> (32 - MAX_PLAYERS) : (1u << r->joined) - 1;
+    for(i = 0; i < INDEX_SIZE; i++){
+        entry* e = &r->index[i];
+        if(e->text[0] == '\0'){
+            if(e->players != 0) return "empty slot with players";
+            continue;
+        }
+        words++;
+        if(e->players == 0 || (e->players & ~seated) != 0) return "word of no seated player";
+        if(__builtin_popcount(e->players) >= state->quorum) return "word at quorum in a running game";
+        if(lookup(r, e->text, false) != e) return "word not found in the index";
+    }
+    if(words != r->entries) return "index entries out of sync";
+    return NULL;
+}
+
+/*Run a seeded random schedule of players against the game and the sessions,
+  with no sockets: the same calls the server makes for each request, checked
+  after every event, then report the throughput. The same seed replays the
+  same schedule*/
+static void simulate(long events, uint64_t seed, int players, int quorum){
+    static char const * const ACTIONS[] = {"start", "guess", "quit", "disconnect", "session"};
+    static char const * const OUTCOMES[] = {"seated", "left", "no vacancy", "accepted",
+        "discarded", "ignored", "completed", "not playing"};
+    int population = players * MAX_ROOMS + players;
+    long counts[5] = {0};
+    long outcomes[8] = {0};
+    uint32_t digest = 2166136261u;
+    //the words guessed, the last ones are ignored in a running game
+    keyword vocabulary[27];
+    keyword common[2] = {"the", "and"};
+    char* text;
+    char name[NAME_LENGTH];
+    char found[NAME_LENGTH];
+    struct timespec start, end;
+    char const* broken;
+    long event;
+    int i;
+
+    simulating = true;
+    seedRandom(seed);
+    state = mmap(NULL, sizeof(shared), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(state == MAP_FAILED){
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    initState(players, quorum);
+    claimSlot();
+    buildDictionary(&stopwords, common, 2);
+    for(i = 0; i < 24; i++) sprintf(vocabulary[i], "word%d", i);
+    strcpy(vocabulary[24], "the");
+    strcpy(vocabulary[25], "and");
+    vocabulary[26][0] = '\0';
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(event = 0; event < events; event++){
+        int p = nextRandom() % population;
+        int action = nextRandom() % 100;
+        room* chosen = &state->rooms[nextRandom() % MAX_ROOMS];
+        bool seated, unsettled;
+        outcome result = SEATED;
+        room* before;
+        view v;
+        int words = 0;
+
+        //the simulation is the only process, it inspects the rooms without locking them
+        //three events in four are played by a seated player of a room, when it has one
+        if(nextRandom() % 4 != 0 && chosen->joined > 0){
+            i = chosen->seats[nextRandom() % chosen->joined].who.sockfd;
+            if(i >= 0) p = i;
+        }
+        action = action < 20 ? 0 : action < 90 ? 1 : action < 93 ? 2 : action < 96 ? 3 : 4;
+        seated = isPlayer(p);
+        before = roomOf(p);
+        unsettled = samePlayer(before->unsettled[seatIndex[p]], self(p));
+        //a seated player leaves less often in a larger room, so that it fills and its game runs
+        if(seated && (action == 0 || action == 2 || action == 3) && nextRandom() % players != 0) action = 1;
+        //a player out of any game mostly presses start rather than guess
+        if(!seated && !unsettled && action == 1 && nextRandom() % 8 != 0) action = 0;
+        counts[action]++;
+        if(seated) words = before->seats[seatIndex[p]].words;
+
+        if(action == 0){
+            result = startGame(p, &v);
+            if(result == LEFT && (!seated || isPlayer(p))) simFail(seed, event, "start did not end the game");
+            if(result == SEATED && (seated || !isPlayer(p))) simFail(seed, event, "start did not seat the player");
+            if(result == NO_VACANCY){
+                for(i = 0; i < MAX_ROOMS; i++)
+                    if(state->rooms[i].stage != READY) simFail(seed, event, "no vacancy with a room open");
+            }
+        } else if(action == 1){
+            text = vocabulary[nextRandom() % 27];
+            result = guessWord(p, text, &v);
+            if(result == NOT_PLAYING && (seated || unsettled)) simFail(seed, event, "player lost its game");
+            if(result == COMPLETED && !unsettled && (!seated || before->stage != STANDBY))
+                simFail(seed, event, "completed a game that is still running");
+            if(result == ACCEPTED && v.words != words + 1 && words != MAX_WORDS)
+                simFail(seed, event, "accepted word not listed");
+            if(result == DISCARDED && before->stage == READY) simFail(seed, event, "discarded in a running game");
+            if((result == IGNORED) != (result != NOT_PLAYING && result != COMPLETED && before->stage == READY
+                                       && (text[0] == '\0' || contains(&stopwords, text))))
+                simFail(seed, event, "stopword not ignored or word ignored");
+        } else if(action == 2){
+            quitGame(p);
+            if(isPlayer(p)) simFail(seed, event, "quit did not end the game");
+        } else if(action == 3){
+            disconnect(p);
+            if(isPlayer(p) || settle(p)) simFail(seed, event, "disconnect left the player behind");
+        }
+
+        if(action < 4){
+            //quit and disconnect have no outcome, only the action is recorded
+            if(action < 2) outcomes[result]++;
+            digest = (digest ^ (action * 8 + result)) * 16777619u;
+            if((broken = checkRoom(before)) != NULL || (broken = checkRoom(roomOf(p))) != NULL)
+                simFail(seed, event, broken);
+        }
+
+        if(action == 4){
+            sprintf(name, "player%d", p);
+            long sessionID = generateCookie(name);
+            if(!searchCookie(sessionID, found) || strcmp(found, name))
+                simFail(seed, event, "session not found");
+            digest = (digest ^ (uint32_t) sessionID) * 16777619u;
+        }
+
+        //check every room once in a while
+        if((event & 0xffff) == 0xffff){
+            for(i = 0; i < MAX_ROOMS; i++){
+                if((broken = checkRoom(&state->rooms[i])) != NULL || (broken = checkIndex(&state->rooms[i])) != NULL)
+                    simFail(seed, event, broken);
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = elapsed(&start, &end) / 1e9;
+    printf("simulated %ld events of %d players in rooms of %d, quorum %d, seed %llu\n",
+           events, population, players, quorum, (unsigned long long) seed);
+    printf("%.3fs, %.0f events per second, digest %08x\n", seconds, events / seconds, digest);
+    for(i = 0; i < 5; i++) printf("%s %ld\n", ACTIONS[i], counts[i]);
+    for(i = 0; i < 8; i++) printf("%s %ld\n", OUTCOMES[i], outcomes[i]);
+}
+
+//Serve a request, timed by the tracer when it is enabled
+static bool handle_http_request(int sockfd)
+{
+    bool served;
+    traceBegin(sockfd);
+    served = serve_http_request(sockfd);
+    traceEnd();
+    return served;
+}
+
 int main(int argc, char * argv[])
 {
-    //initialise the random generator with random seed
-    srand (time(NULL));
+    //initialise the random generator with a seed unique to this process
+    seedRandom(time(NULL) ^ getpid());
+
+    //read the options, a room holds two players by default
+    char const* shmName = DEFAULT_SHM_NAME;
+    int players = 2;
+    int quorum = 2;
+    long events = 0;
+    uint64_t seed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:n:k:t:S:r:")) != -1)
+    {
+        if (opt == 's')
+            shmName = optarg;
+        else if (opt == 'n')
+            players = atoi(optarg);
+        else if (opt == 'k')
+            quorum = atoi(optarg);
+        else if (opt == 't')
+            traceThreshold = atol(optarg) * 1000;
+        else if (opt == 'S')
+            events = atol(optarg);
+        else if (opt == 'r')
+            seed = strtoull(optarg, NULL, 10);
+        else
+            argc = 0;
+    }
 
-    if (argc < 3)
+    if ((events <= 0 && argc - optind < 2) || players < 1 || players > MAX_PLAYERS || quorum < 1 || quorum > players || traceThreshold < 0)
     {
-        fprintf(stderr, "usage: %s ip port\n", argv[0]);
+        fprintf(stderr, "usage: %s [-s shm-name] [-n players] [-k quorum] [-t slow-us] ip port\n", argv[0]);
+        fprintf(stderr, "       %s -S events [-r seed] [-n players] [-k quorum]\n", argv[0]);
         return 0;
     }
 
+    //run the game without the network
+    if (events > 0)
+    {
+        simulate(events, seed, players, quorum);
+        return 0;
+    }
+
+    //attach to the game state shared with the other server processes
+    attachState(shmName, players, quorum);
+    loadDictionaries();
+
+    //a client hanging up must not kill the process, the write fails instead
+    signal(SIGPIPE, SIG_IGN);
+
+    /*dump the slow requests on SIGUSR1. The calls serving a client are
+      restarted, select is never restarted on Linux and returns to the dump*/
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestDump;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+
     // create TCP socket which only accept IPv4
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0)
@@ -684,13 +1803,20 @@ int main(int argc, char * argv[])
         exit(EXIT_FAILURE);
     }
 
+    // let several server processes share the port
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(int)) < 0)
+    {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+
     // create and initialise address we will listen on
     struct sockaddr_in serv_addr;
     bzero(&serv_addr, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
     // if ip parameter is not specified
-    serv_addr.sin_addr.s_addr = inet_addr(argv[1]);
-    serv_addr.sin_port = htons(atoi(argv[2]));
+    serv_addr.sin_addr.s_addr = inet_addr(argv[optind]);
+    serv_addr.sin_port = htons(atoi(argv[optind + 1]));
 
     // bind address to socket
     if (bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
@@ -713,7 +1839,15 @@ int main(int argc, char * argv[])
     {
         // monitor file descriptors
         fd_set readfds = masterfds;
-        if (select(FD_SETSIZE, &readfds, NULL, NULL, NULL) < 0)
+        int ready = select(FD_SETSIZE, &readfds, NULL, NULL, NULL);
+        if (dumpRequested)
+        {
+            dumpRequested = 0;
+            traceDump(maxfd);
+        }
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready < 0)
         {
             perror("select");
             exit(EXIT_FAILURE);
@@ -753,13 +1887,10 @@ int main(int argc, char * argv[])
                 else if (!handle_http_request(i))
                 {
                     //reset the server parameters when disconnected
-                    if(isPlayer(i))reset();
-
-                    if(unsettledsock == i){
-                        unsettledsock = -1;
-                    }
+                    disconnect(i);
 
                     close(i);
+                    traceClose(i);
                     FD_CLR(i, &masterfds);
                 }
             }